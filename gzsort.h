@@ -0,0 +1,80 @@
+/*
+gzsort.h is licensed GPLv3
+copyright Kyle Keen, 2016
+
+libgzsort, the sort behind gz-sort as a library
+
+whole files:
+    gzsort_file() and gzsort_merge() are what the command line runs
+
+streaming:
+    s = gzsort_new(&options);
+    gzsort_push(s, line, length);  // or gzsort_push_buffer() with raw bytes
+    ...
+    while ((line = gzsort_pull(s, &length)) != NULL)
+        {...}
+    gzsort_free(s);
+
+a stream is sorted in ram until the presort fills, then it spills
+compressed segments to a temp file that gzsort_free() removes
+*/
+
+#ifndef GZSORT_H
+#define GZSORT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define RECORD_TEXT 0    // newline terminated lines
+#define RECORD_FIXED 1   // record_width bytes each
+#define RECORD_VARINT 2  // each after a varint of its length
+
+typedef struct
+// the command line options, see gzsort_options() for the defaults
+{
+    int unique;             // -u
+    int64_t presort_bytes;  // -S, 0 for the default
+    int threads;            // -P, -1 if unset
+    int affinity;           // -A
+    int64_t limit;          // -L, 0 for everything
+    int estimate;           // -E
+    int64_t disk_cap;       // -D
+    int pass_through;       // -T
+    int record_mode;        // -R and -V
+    int record_width;
+    int key_start;          // -K, key_len 0 for the whole record
+    int key_len;
+    char* temp_dir;         // streaming only, NULL for $TMPDIR or /tmp
+    FILE* log;              // progress and -E reports, NULL for none
+} gzsortOptions;
+
+typedef struct sortBucket gzsortBucket;
+
+int gzsort_options(gzsortOptions* options);
+
+// these return 0 on success
+int gzsort_file(gzsortOptions* options, char* input_path, char* output_path);
+int gzsort_merge(gzsortOptions* options, char** paths, int count, char* output_path);
+
+// NULL if the options are bad or the presort does not fit in ram
+// threads, affinity, estimate and pass_through are ignored
+// with a limit only the candidates stay in ram, like -L, and nothing spills
+gzsortBucket* gzsort_new(gzsortOptions* options);
+
+// one line without its newline, or one record without its varint
+int gzsort_push(gzsortBucket* s, char* str, int length);
+
+// raw bytes as they would be in source.gz, records may straddle calls
+int gzsort_push_buffer(gzsortBucket* s, char* data, int64_t length);
+
+// the first pull finishes the sort, after that no more pushes
+// the record stays valid until the next pull, NULL at the end
+char* gzsort_pull(gzsortBucket* s, int* length);
+
+// fills data with raw bytes as they would be in dest.gz
+// returns how many, 0 at the end and -1 on error
+int64_t gzsort_pull_buffer(gzsortBucket* s, char* data, int64_t size);
+
+int gzsort_free(gzsortBucket* s);
+
+#endif
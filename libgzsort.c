@@ -0,0 +1,2609 @@
+/*
+libgzsort.c is licensed GPLv3
+copyright Kyle Keen, 2016
+
+perform a merge sort over a multi-gigabyte gz compressed file
+everything but the command line, see gzsort.h
+
+compile: gcc -Wall -Os -c libgzsort.c
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "gzsort.h"
+
+#ifdef __OpenBSD__
+#define NO_GZBUFFER    /* gzbuffer() not in OpenBSD zlib */
+#endif
+
+#ifndef __linux__
+#define NO_AFFINITY    /* cpu_set_t and sysfs are linux only */
+#else
+#include <sched.h>
+#endif
+
+#define CHUNK 16384
+#define LINE_START 1024
+#define GZ_BUFFER 65536
+#define PRESORT_WINDOW 1000000
+#define SAMPLE_BYTES 4000000
+#define NWAY_WINDOW 1000
+#define MAX_THREADS 64
+#define MAX_NODES 64
+#define MAX_FANIN 256
+#define SPARE_FILES 16
+#define PASS_AHEAD 4
+#define RADIX_MIN 32
+#define VARINT_MAX 5
+#define BOUND_LEN 24
+
+#define MEMCHECK if (r<0) {fprintf(stderr, "ERROR: memory\n"); return 1;}
+
+typedef struct
+// how the source is split into records and what they sort on
+{
+    int mode;       // RECORD_TEXT, RECORD_FIXED or RECORD_VARINT
+    int width;      // bytes per RECORD_FIXED record
+    int key_start;  // byte range of the key, key_len 0 for all of it
+    int key_len;
+} recordFormat;
+
+typedef struct
+// a bounded prefix of the first or last record in a segment, see run_order()
+// the key bytes come first, then as much of the record as still fits
+{
+    unsigned char used;        // 0 for an empty segment
+    unsigned char key_n;
+    unsigned char key_whole;   // 1 if key_n covers the whole key
+    unsigned char rec_n;
+    unsigned char rec_whole;   // 1 if rec_n covers the whole record
+    char bytes[BOUND_LEN];
+} boundKey;
+
+typedef struct
+// maintains all state related to the GZ process
+{
+    char* path;
+    gzFile f;
+    int fd;  // for writers and segment readers, see copy_bytes()
+    z_stream* zs;  // segment readers inflate by hand, see read_gz()
+    unsigned char* zbuf;
+    int64_t zpos;
+    int64_t zend;
+    int read_len;
+    char buffer[CHUNK + 1];
+    int buf_i;
+    char* line;  // dynamically expanded/reused
+    char* str;   // points to line or buffer
+    int str_len;
+    int line_len;
+    int line_i;
+    int64_t subset_counter;
+    int64_t line_counter;
+    int64_t nway_lines;
+    int64_t nway_skips;
+    int error;  // read_gz() hit a short read or corrupt data
+    recordFormat* format;
+} gzBucket;
+
+typedef struct
+// holds misc state and settings
+{
+    char* label;
+    int64_t total_lines;
+    int64_t presort_bytes;
+    int64_t* line_log;  // "pointers" to where each segment starts
+    int64_t* byte_log;  // compressed size of each segment
+    boundKey* first_log;  // smallest line in each segment
+    boundKey* last_log;   // largest line in each segment
+    int64_t log_len;
+    recordFormat* format;
+    FILE* log;          // progress reports, NULL for none
+    int pass_through;
+    int unique;
+    int nway;
+    int affinity;
+    int64_t limit;
+    int64_t disk_cap;
+    char* temp_mode;  // gzopen() mode for intermediate files
+    char* out_mode;   // and for the last level of middle_passes()
+} miscBucket;
+
+typedef struct
+// thread state
+{
+    pthread_t sort_thread;
+    char* label;
+    char* source_path;
+    char* in_path;
+    char* out_path;
+    int thread_index;
+    int status;  // non-zero if the chop, presort or a merge failed
+    miscBucket misc;
+} threadBucket;
+
+typedef struct passBucket
+// one level of the merge tree
+{
+    pthread_t pass_thread;
+    char* path;
+    int64_t segments;  // how many this level will hold
+    int64_t done;      // how many are completely written
+    int64_t consumed;  // how many the level above has merged
+    int64_t* line_log;
+    int64_t* byte_log;
+    boundKey* first_log;
+    boundKey* last_log;
+    int64_t line_counter;
+    char* mode;
+    int unique;
+    int status;
+    miscBucket* misc;
+    pthread_mutex_t* lock;  // shared by all levels
+    pthread_cond_t* cond;
+} passBucket;
+
+typedef struct
+// the presort buffer as it fills, see presort_add()
+{
+    char* buffer;        // fixed length, unless a record is bigger
+    int64_t buffer_len;
+    char** strings;      // grows, unused for RECORD_FIXED
+    int64_t strings_len;
+    int64_t strings_i;
+    int64_t buf_i;
+    int64_t log_i;
+    int64_t offset;      // where the next segment starts
+    char* temp;          // one record for radix_sort()
+    recordFormat* format;
+} presortBucket;
+
+typedef struct
+// the -L candidates, packed into one buffer like the presort
+{
+    char* buffer;
+    char* spare;         // limit_trim() compacts into this and swaps
+    int64_t buffer_len;
+    int64_t buf_i;
+    char** strings;      // room for 2x limit
+    int64_t count;
+    char* cutoff;        // nothing at or past this can make the cut
+    int64_t limit;
+    int unique;
+    recordFormat* format;
+} limitBucket;
+
+typedef struct
+// a line waiting in the nway heap
+{
+    char* str;
+    int len;
+    int source;  // which input it came from
+} heapItem;
+
+static int init_gz(gzBucket* g, char* path, char* mode, recordFormat* format)
+{
+    g->line_len = LINE_START;
+    g->line_i = 0;
+    g->buf_i = 0;
+    g->line = NULL;
+    g->path = path;
+    g->format = format;
+    g->fd = -1;
+    g->zs = NULL;
+    // writers keep the fd around to append raw gzip members
+    if (mode[0] == 'w')
+    {
+        g->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        g->f = (g->fd < 0) ? NULL : gzdopen(g->fd, mode);
+    }
+    else
+        {g->f = gzopen(path, mode);}
+    if (!g->f)
+    {
+        fprintf(stderr, "ERROR: %s not a .gz file\n", path) ;  
+        return 1 ;  
+    } 
+#ifndef NO_GZBUFFER
+    gzbuffer(g->f, GZ_BUFFER);
+#endif
+    g->line = malloc(g->line_len + 1);
+    g->subset_counter = 0;
+    g->line_counter = 0;
+    g->error = 0;
+
+    // seed the read
+    if (mode[0] == 'r')
+        {g->read_len = gzread(g->f, &g->buffer, CHUNK);}
+    return 0;
+}
+
+static int init_segment_gz(gzBucket* g, char* path, recordFormat* format)
+// a reader that never looks past the end of the segment it was given
+// so it is safe on a file that another pass is still appending to
+{
+    g->line_len = LINE_START;
+    g->line_i = 0;
+    g->buf_i = 0;
+    g->read_len = 0;
+    g->path = path;
+    g->format = format;
+    g->f = NULL;
+    // writable only so that merged segments can be punched out
+    g->fd = open(path, O_RDWR);
+    if (g->fd < 0)
+    {
+        fprintf(stderr, "ERROR: could not open %s\n", path);
+        return 1;
+    }
+    g->zs = calloc(1, sizeof(z_stream));
+    g->zbuf = malloc(GZ_BUFFER);
+    g->line = malloc(g->line_len + 1);
+    if (g->zs == NULL || g->zbuf == NULL || g->line == NULL)
+        {return 1;}
+    // 16 for gzip headers
+    if (inflateInit2(g->zs, 16 + MAX_WBITS) != Z_OK)
+        {return 1;}
+    g->zpos = 0;
+    g->zend = 0;
+    g->subset_counter = 0;
+    g->line_counter = 0;
+    g->error = 0;
+    return 0;
+}
+
+static int close_gz(gzBucket* g)
+{
+    if (g->zs != NULL)
+    {
+        inflateEnd(g->zs);
+        free(g->zs);
+        free(g->zbuf);
+        close(g->fd);
+    }
+    else
+        {gzclose(g->f);}
+    free(g->line);
+    return 0;
+}
+
+static int read_gz(gzBucket* g)
+// fills the buffer, returns how much like gzread()
+{
+    z_stream* zs = g->zs;
+    ssize_t got;
+    int ret;
+    if (zs == NULL)
+    {
+        ret = gzread(g->f, &g->buffer, CHUNK);
+        if (ret < 0)
+        {
+            fprintf(stderr, "ERROR: %s is corrupt\n", g->path);
+            g->error = 1;
+            return 0;
+        }
+        return ret;
+    }
+    zs->next_out = (unsigned char*)g->buffer;
+    zs->avail_out = CHUNK;
+    while (zs->avail_out > 0)
+    {
+        if (zs->avail_in == 0)
+        {
+            if (g->zpos >= g->zend)
+                {break;}
+            got = pread(g->fd, g->zbuf, (g->zend - g->zpos < GZ_BUFFER) ? g->zend - g->zpos : GZ_BUFFER, g->zpos);
+            if (got <= 0)
+            {
+                fprintf(stderr, "ERROR: %s is short\n", g->path);
+                g->error = 1;
+                break;
+            }
+            g->zpos += got;
+            zs->next_in = g->zbuf;
+            zs->avail_in = got;
+        }
+        ret = inflate(zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)  // next member
+            {inflateReset(zs);}
+        else if (ret != Z_OK)
+        {
+            fprintf(stderr, "ERROR: %s is corrupt\n", g->path);
+            g->error = 1;
+            break;
+        }
+    }
+    return CHUNK - zs->avail_out;
+}
+
+static int seek_gz(gzBucket* g, int64_t offset, int64_t end, int64_t line)
+// point a segment reader at the gzip members in [offset, end)
+{
+    inflateReset(g->zs);
+    g->zs->avail_in = 0;
+    g->zpos = offset;
+    g->zend = end;
+    g->line_i = 0;
+    g->buf_i = 0;
+    g->read_len = read_gz(g);
+    g->line_counter = line;
+    return 0;
+}
+
+static int64_t finish_member_gz(gzBucket* g)
+// completes the current gzip member, returns the file offset after it
+{
+    gzflush(g->f, Z_FINISH);
+    return (int64_t)lseek(g->fd, 0, SEEK_CUR);
+}
+
+static int copy_bytes(int in_fd, int64_t offset, int64_t length, gzBucket* out)
+// appends compressed members verbatim, out must be at a member boundary
+{
+    char buffer[CHUNK];
+    ssize_t got;
+    while (length > 0)
+    {
+        got = pread(in_fd, buffer, length < CHUNK ? length : CHUNK, offset);
+        if (got <= 0 || write(out->fd, buffer, got) != got)
+        {
+            fprintf(stderr, "ERROR: could not copy to %s\n", out->path);
+            return 1;
+        }
+        offset += got;
+        length -= got;
+    }
+    return 0;
+}
+
+static int init_all(gzBucket* in1, gzBucket* in2, gzBucket* out, char* path1, char* path2, char* mode, recordFormat* format)
+{
+    if (init_gz(in1, path1, "rb", format))
+        {return 1;}
+    if (init_gz(in2, path1, "rb", format))
+        {return 1;}
+    if (init_gz(out, path2, mode, format))
+        {return 1;}
+    return 0;
+}
+
+static int append_line_gz(gzBucket* g, char* str, int length)
+// this handles growth
+{
+    // str does not fit, line must grow
+    while (g->line_i + length >= g->line_len)
+    {
+        g->line_len *= 2;
+        g->line = realloc(g->line, g->line_len+1);
+    }
+    // now str can fit in line
+    memcpy(g->line+g->line_i, str, length);
+    // advance pointers along
+    g->line_i += length;
+    return 0;
+}
+
+static char* cut_record_gz(gzBucket* g)
+// the source ended inside a record, which is as bad as a short read
+{
+    if (!g->error)
+        {fprintf(stderr, "ERROR: %s ends inside a record\n", g->path);}
+    g->error = 1;
+    return NULL;
+}
+
+static char* take_bytes_gz(gzBucket* g, int length)
+// the next length bytes in one piece, NULL if the source runs out
+{
+    char* found;
+    int n;
+    if (g->buf_i + length <= g->read_len)
+    {
+        found = g->buffer + g->buf_i;
+        g->buf_i += length;
+        return found;
+    }
+    // straddles a chunk, gather it in line
+    g->line_i = 0;
+    while (g->line_i < length)
+    {
+        if (g->buf_i >= g->read_len)
+        {
+            g->read_len = read_gz(g);
+            g->buf_i = 0;
+            if (g->read_len <= 0 && g->line_i)
+                {g->line_i = 0; return cut_record_gz(g);}
+            if (g->read_len <= 0)
+                {return NULL;}
+        }
+        n = g->read_len - g->buf_i;
+        if (n > length - g->line_i)
+            {n = length - g->line_i;}
+        append_line_gz(g, g->buffer + g->buf_i, n);
+        g->buf_i += n;
+    }
+    g->line_i = 0;
+    return g->line;
+}
+
+static char* load_record_gz(gzBucket* g)
+// load_line_gz() for binary records, which are not terminated
+{
+    unsigned char* byte;
+    char* found;
+    int64_t length = g->format->width;
+    int shift;
+    if (g->format->mode == RECORD_VARINT)
+    {
+        length = 0;
+        for (shift=0; shift < 7*VARINT_MAX; shift += 7)
+        {
+            byte = (unsigned char*)take_bytes_gz(g, 1);
+            if (byte == NULL && shift)
+                {return cut_record_gz(g);}
+            if (byte == NULL)
+                {return NULL;}
+            length |= (int64_t)(*byte & 0x7f) << shift;
+            if (!(*byte & 0x80))
+                {break;}
+        }
+        if (shift >= 7*VARINT_MAX || length > INT32_MAX / 2)
+        {
+            fprintf(stderr, "ERROR: %s has a bad record length\n", g->path);
+            g->error = 1;
+            return NULL;
+        }
+    }
+    found = take_bytes_gz(g, length);
+    // a varint promised these bytes
+    if (found == NULL && g->format->mode == RECORD_VARINT)
+        {return cut_record_gz(g);}
+    if (found == NULL)
+        {return NULL;}
+    g->line_counter++;
+    g->str = found;
+    g->str_len = length;
+    return found;
+}
+
+static char* load_line_gz(gzBucket* g)
+// returns NULL if out of lines
+{
+    char* found = NULL;
+    int i;
+    if (g->format->mode != RECORD_TEXT)
+        {return load_record_gz(g);}
+    while (g->read_len)
+    {
+        // out of buffer?  load more
+        if (g->buf_i >= g->read_len)
+        {
+            g->read_len = read_gz(g);
+            g->buf_i = 0;
+            // a last line without its newline still counts
+            if (!g->read_len && g->line_i && !g->error)
+            {
+                g->line[g->line_i] = '\0';
+                g->line_counter++;
+                g->str = g->line;
+                g->str_len = g->line_i;
+                g->line_i = 0;
+                return g->line;
+            }
+        }
+        // scan ahead for newline
+        for (i=g->buf_i; i<g->read_len; i++)
+        {
+            if (g->buffer[i] == '\n')
+            {
+                g->buffer[i] = '\0';
+                g->line_counter++;
+                break;
+            }
+        }
+        if (i == g->read_len)  // did not find newline, append
+        {
+            append_line_gz(g, g->buffer + g->buf_i, i-g->buf_i);
+        }
+        else if (g->line_i)  // cached line, append
+        {
+            // extra +1 because of reasons
+            append_line_gz(g, g->buffer + g->buf_i, i+1-g->buf_i);
+            found = g->line;
+            g->str_len = g->line_i - 1;
+            g->line_i = 0;  // awkward...
+        }
+        else // re-use buffer
+        {
+            found = g->buffer + g->buf_i;
+            g->str_len = i - g->buf_i;
+        }
+        // advance indexes along
+        g->buf_i = i + 1;
+        if (found)
+        {
+            g->str = found;
+            return found;
+        }
+    }
+    return NULL;
+}
+
+static char* subset_lines_gz(gzBucket* g)
+// returns NULL when subset_counter hits zero
+{
+    if (g->subset_counter <= 0)
+        {return NULL;}
+    g->subset_counter--;
+    return load_line_gz(g);
+}
+
+static int skip_lines_gz(gzBucket* g, int skip)
+{
+    int i;
+    for (i=0; i<skip; i++)
+        {load_line_gz(g);}
+    return 0;
+}
+
+static char* nway_line_gz(gzBucket* g)
+// performs the nway_chop while emulating load_line_gz
+// requires that you setup subset_counter & skip beforehand
+// returns NULL when out of lines
+{
+    if (g->subset_counter <= 0)
+    {
+        skip_lines_gz(g, g->nway_skips);
+        g->subset_counter = g->nway_lines;
+    }
+    return subset_lines_gz(g);
+}
+
+static int compare_bytes(char* a, int a_len, char* b, int b_len)
+// memcmp() where a prefix sorts before anything longer
+{
+    int cmp = memcmp(a, b, (a_len < b_len) ? a_len : b_len);
+    if (cmp)
+        {return cmp;}
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+static int compare_records(recordFormat* format, char* a, int a_len, char* b, int b_len)
+// the order of every pass, strcmp() for lines
+// records compare on their key and then on all of their bytes
+{
+    int a_start, b_start, a_key, b_key, cmp;
+    if (format->mode == RECORD_TEXT)
+        {return strcmp(a, b);}
+    if (format->key_len)
+    {
+        // varint records may end before or inside the key
+        a_start = (a_len < format->key_start) ? a_len : format->key_start;
+        b_start = (b_len < format->key_start) ? b_len : format->key_start;
+        a_key = (a_len - a_start < format->key_len) ? a_len - a_start : format->key_len;
+        b_key = (b_len - b_start < format->key_len) ? b_len - b_start : format->key_len;
+        cmp = compare_bytes(a + a_start, a_key, b + b_start, b_key);
+        if (cmp)
+            {return cmp;}
+    }
+    return compare_bytes(a, a_len, b, b_len);
+}
+
+static int write_varint(char* out, unsigned int v)
+// returns how many bytes it took, at most VARINT_MAX
+{
+    int n = 0;
+    while (v > 0x7f)
+        {out[n++] = (v & 0x7f) | 0x80; v >>= 7;}
+    out[n++] = v;
+    return n;
+}
+
+static int read_varint(char* data, int64_t length, int64_t* used, int64_t* value)
+// 1 if data starts with a whole varint, 0 if it is cut off, -1 if too long
+{
+    unsigned char byte;
+    *value = 0;
+    for (*used=0; *used < length; )
+    {
+        byte = data[*used];
+        *value |= (int64_t)(byte & 0x7f) << (7 * *used);
+        (*used)++;
+        if (!(byte & 0x80))
+            {return 1;}
+        if (*used >= VARINT_MAX)
+            {return -1;}
+    }
+    return 0;
+}
+
+static int put_record(gzBucket* out, char* str, int length)
+// writes a line or a record along with its framing
+{
+    char varint[VARINT_MAX];
+    if (out->format->mode == RECORD_VARINT)
+        {gzwrite(out->f, varint, write_varint(varint, length));}
+    if (length > 0)
+        {gzwrite(out->f, str, length);}
+    if (out->format->mode == RECORD_TEXT)
+        {gzputc(out->f, '\n');}
+    return 0;
+}
+
+static int put_unique(gzBucket* out, char* str, int length)
+// put_record() unless it repeats the last one, out->line keeps a copy
+{
+    if (out->line_counter && compare_records(out->format, str, length, out->line, out->line_i) == 0)
+        {return 0;}
+    put_record(out, str, length);
+    out->line_i = 0;
+    append_line_gz(out, str, length);
+    out->line[out->line_i] = '\0';
+    out->line_counter++;
+    return 1;
+}
+
+static char* pack_record(char* buffer, char* str, int length)
+// a copy that outlives the read buffer, see record_len()
+// takes sizeof(int) + length + 1 bytes of buffer
+{
+    memcpy(buffer, &length, sizeof(int));
+    memcpy(buffer + sizeof(int), str, length);
+    buffer[sizeof(int) + length] = '\0';
+    return buffer + sizeof(int);
+}
+
+static int record_len(char* str)
+// records kept in ram carry their length just in front
+// and a '\0' after, so lines still work with strcmp()
+{
+    int length;
+    memcpy(&length, str - sizeof(int), sizeof(int));
+    return length;
+}
+
+static int bound_part(char* a, int a_n, int a_whole, char* b, int b_n, int b_whole, int* cmp)
+// compare_bytes() on two prefixes, 0 if they can not tell the records apart
+{
+    *cmp = memcmp(a, b, (a_n < b_n) ? a_n : b_n);
+    if (*cmp)
+        {return 1;}
+    // a whole one that is no longer than the other is its prefix
+    if (a_whole && b_whole)
+        {*cmp = (a_n > b_n) - (a_n < b_n); return 1;}
+    if (a_whole && a_n <= b_n)
+        {*cmp = -1; return 1;}
+    if (b_whole && b_n <= a_n)
+        {*cmp = 1; return 1;}
+    return 0;
+}
+
+static int bound_compare(boundKey* a, boundKey* b, int* cmp)
+// compare_records() on two boundKeys, 0 if the prefixes are not enough
+{
+    if (!bound_part(a->bytes, a->key_n, a->key_whole, b->bytes, b->key_n, b->key_whole, cmp))
+        {return 0;}
+    if (*cmp)
+        {return 1;}
+    return bound_part(a->bytes + a->key_n, a->rec_n, a->rec_whole,
+        b->bytes + b->key_n, b->rec_n, b->rec_whole, cmp);
+}
+
+static int set_bound(recordFormat* format, boundKey* k, char* str, int length)
+// keeps as much of a record as a boundKey holds
+{
+    int start = 0;
+    int key = 0;
+    if (format->mode == RECORD_TEXT)
+        {length = strnlen(str, length);}  // strcmp() stops at a '\0'
+    if (format->key_len)
+    {
+        start = (length < format->key_start) ? length : format->key_start;
+        key = (length - start < format->key_len) ? length - start : format->key_len;
+    }
+    k->used = 1;
+    k->key_n = (key < BOUND_LEN) ? key : BOUND_LEN;
+    k->key_whole = (k->key_n == key);
+    k->rec_n = 0;
+    k->rec_whole = 0;
+    memcpy(k->bytes, str + start, k->key_n);
+    // the record only matters once the keys tie
+    if (!k->key_whole)
+        {return 0;}
+    k->rec_n = (length < BOUND_LEN - k->key_n) ? length : BOUND_LEN - k->key_n;
+    k->rec_whole = (k->rec_n == length);
+    memcpy(k->bytes + k->key_n, str, k->rec_n);
+    return 0;
+}
+
+static int log_printf(FILE* log, char* fmt, ...)
+// progress reports go nowhere unless the caller asked for them
+{
+    va_list args;
+    if (log == NULL)
+        {return 0;}
+    va_start(args, fmt);
+    vfprintf(log, fmt, args);
+    va_end(args);
+    return 0;
+}
+
+static int report_time(FILE* log, time_t start, char* fmt, ...)
+{
+    time_t finish = time(NULL);
+    int seconds = finish - start;
+    float minutes;
+    va_list args;
+    if (seconds <= 1 || log == NULL)
+        {return 0;}
+    va_start(args, fmt);
+    vfprintf(log, fmt, args);
+    va_end(args);
+    if (seconds < 100)
+    {
+        fprintf(log, ": %i seconds\n", seconds);
+        return seconds;
+    }
+    minutes = (float)seconds / 60;
+    fprintf(log, ": %.2f minutes\n", minutes);
+    return seconds;
+}
+
+static int simple_pass(gzBucket* in1, gzBucket* out)
+{
+    char* str1;
+    while (1)
+    {
+        str1 = load_line_gz(in1);
+        if (str1 == NULL)
+            {break;}
+        put_record(out, str1, in1->str_len);
+    }
+    return 0;
+}
+
+static int pass_through_pass(char* input_path, char* output_path, miscBucket* misc)
+{
+    gzBucket in1;
+    gzBucket in2;
+    gzBucket out;
+    time_t start;
+    if (init_all(&in1, &in2, &out, input_path, output_path, "wb", misc->format))
+        {return 1;}
+    start = time(NULL);
+    simple_pass(&in1, &out);
+    report_time(misc->log, start, "passthrough");
+    close_gz(&in1); close_gz(&in2); close_gz(&out);
+    return in1.error;
+}
+
+static int qsort_compare(const void* a, const void* b, void* format)
+// for qsort_r(), which carries the recordFormat along
+{
+    const char** str1 = (const char **)a;
+    const char** str2 = (const char **)b;
+    if (*str1 == NULL)
+        {return 1;}
+    if (*str2 == NULL)
+        {return -1;}
+    return compare_records(format, (char*)*str1, record_len((char*)*str1), (char*)*str2, record_len((char*)*str2));
+}
+
+static int limit_init(limitBucket* lb, miscBucket* misc)
+{
+    lb->buffer_len = CHUNK;
+    lb->buffer = malloc(lb->buffer_len);
+    lb->spare = malloc(lb->buffer_len);
+    lb->strings = malloc(sizeof(char*) * misc->limit * 2);
+    if (lb->buffer == NULL || lb->spare == NULL || lb->strings == NULL)
+        {return 1;}
+    lb->buf_i = 0;
+    lb->count = 0;
+    lb->cutoff = NULL;
+    lb->limit = misc->limit;
+    lb->unique = misc->unique;
+    lb->format = misc->format;
+    return 0;
+}
+
+static int limit_free(limitBucket* lb)
+{
+    free(lb->buffer);
+    free(lb->spare);
+    free(lb->strings);
+    return 0;
+}
+
+static int limit_trim(limitBucket* lb, int64_t room)
+// sorts the candidates, keeps the smallest limit of them and compacts
+// the buffer, which grows until it is no more than half full with room
+{
+    char* swap;
+    int64_t i, kept, used, size;
+    qsort_r(lb->strings, lb->count, sizeof(char*), qsort_compare, lb->format);
+    kept = 0;
+    used = 0;
+    for (i=0; i<lb->count && kept < lb->limit; i++)
+    {
+        if (lb->unique && kept && compare_records(lb->format, lb->strings[i], record_len(lb->strings[i]),
+            lb->strings[kept-1], record_len(lb->strings[kept-1])) == 0)
+            {continue;}
+        lb->strings[kept] = lb->strings[i];
+        used += sizeof(int) + record_len(lb->strings[i]) + 1;
+        kept++;
+    }
+    size = lb->buffer_len;
+    while (used + room > size / 2)
+        {size *= 2;}
+    if (size != lb->buffer_len)
+    {
+        free(lb->spare);
+        lb->spare = malloc(size);
+        if (lb->spare == NULL)
+            {fprintf(stderr, "ERROR: memory\n"); return 1;}
+    }
+    lb->buf_i = 0;
+    for (i=0; i<kept; i++)
+    {
+        lb->strings[i] = pack_record(lb->spare + lb->buf_i, lb->strings[i], record_len(lb->strings[i]));
+        lb->buf_i += sizeof(int) + record_len(lb->strings[i]) + 1;
+    }
+    swap = lb->buffer;
+    lb->buffer = lb->spare;
+    lb->spare = swap;
+    if (size != lb->buffer_len)
+    {
+        free(lb->spare);
+        lb->spare = malloc(size);
+        lb->buffer_len = size;
+        if (lb->spare == NULL)
+            {fprintf(stderr, "ERROR: memory\n"); return 1;}
+    }
+    lb->count = kept;
+    lb->cutoff = (kept == lb->limit) ? lb->strings[kept-1] : NULL;
+    return 0;
+}
+
+static int limit_add(limitBucket* lb, char* str, int length)
+// keeps str if it could still make the cut, 1 if out of memory
+{
+    int64_t size = sizeof(int) + length + 1;
+    if (lb->cutoff != NULL && compare_records(lb->format, str, length, lb->cutoff, record_len(lb->cutoff)) >= 0)
+        {return 0;}
+    if (lb->count >= lb->limit * 2 || lb->buf_i + size > lb->buffer_len)
+    {
+        if (limit_trim(lb, size))
+            {return 1;}
+        // the cutoff might have moved past it
+        if (lb->cutoff != NULL && compare_records(lb->format, str, length, lb->cutoff, record_len(lb->cutoff)) >= 0)
+            {return 0;}
+    }
+    lb->strings[lb->count] = pack_record(lb->buffer + lb->buf_i, str, length);
+    lb->buf_i += size;
+    lb->count++;
+    return 0;
+}
+
+static int limit_pass(char* input_path, char* output_path, miscBucket* misc)
+// only the first misc->limit lines of the sorted output
+// a single pass over the source, with room for 2x limit lines in ram
+{
+    gzBucket in1;
+    gzBucket out;
+    time_t start;
+    limitBucket lb;
+    char* str1;
+    int64_t i;
+    if (init_gz(&in1, input_path, "rb", misc->format))
+        {return 1;}
+    if (init_gz(&out, output_path, "wb", misc->format))
+        {return 1;}
+    start = time(NULL);
+    if (limit_init(&lb, misc))
+        {limit_free(&lb); return 1;}
+    while ((str1 = load_line_gz(&in1)) != NULL)
+    {
+        if (limit_add(&lb, str1, in1.str_len))
+            {break;}
+    }
+    if (str1 != NULL || in1.error || limit_trim(&lb, 0))
+        {limit_free(&lb); close_gz(&in1); close_gz(&out); return 1;}
+    for (i=0; i<lb.count; i++)
+        {put_record(&out, lb.strings[i], record_len(lb.strings[i]));}
+    report_time(misc->log, start, "limit");
+    limit_free(&lb);
+    close_gz(&in1); close_gz(&out);
+    return 0;
+}
+
+static int grow_logs(miscBucket* misc, int64_t log_i)
+// (re)allocates the segment logs to log_len, clears from log_i onwards
+{
+    int64_t i;
+    misc->line_log  = realloc(misc->line_log,  sizeof(int64_t) * (misc->log_len+1));
+    misc->byte_log  = realloc(misc->byte_log,  sizeof(int64_t) * (misc->log_len+1));
+    misc->first_log = realloc(misc->first_log, sizeof(boundKey) * (misc->log_len+1));
+    misc->last_log  = realloc(misc->last_log,  sizeof(boundKey) * (misc->log_len+1));
+    if (!misc->line_log || !misc->byte_log || !misc->first_log || !misc->last_log)
+        {return 1;}
+    for (i=log_i; i<misc->log_len+1; i++)
+    {
+        misc->line_log[i] = -1;
+        misc->byte_log[i] = 0;
+        misc->first_log[i].used = 0;
+        misc->last_log[i].used = 0;
+    }
+    return 0;
+}
+
+static int radix_byte(recordFormat* format, char* record, int64_t depth)
+// records sort as the bytes of their key followed by all of their bytes
+{
+    if (depth < format->key_len)
+        {return (unsigned char)record[format->key_start + depth];}
+    return (unsigned char)record[depth - format->key_len];
+}
+
+static int swap_records(recordFormat* format, char* a, char* b, char* temp)
+{
+    memcpy(temp, a, format->width);
+    memcpy(a, b, format->width);
+    memcpy(b, temp, format->width);
+    return 0;
+}
+
+static int radix_sort(recordFormat* format, char* base, int64_t count, int64_t depth, char* temp)
+// in place msd radix sort of RECORD_FIXED records, no pointer array
+// temp has room for one record
+{
+    int64_t bucket_end[256];
+    int64_t next[256];
+    int64_t i, j, w, total;
+    int b, c;
+    w = format->width;
+    total = format->key_len + format->width;
+    if (count < RADIX_MIN)
+    {
+        for (i=1; i<count; i++)
+        {
+            for (j=i; j>0 && compare_records(format, base+(j-1)*w, w, base+j*w, w) > 0; j--)
+                {swap_records(format, base+(j-1)*w, base+j*w, temp);}
+        }
+        return 0;
+    }
+    // skip over shared bytes without recursing
+    for (; depth < total; depth++)
+    {
+        memset(bucket_end, 0, sizeof(bucket_end));
+        for (i=0; i<count; i++)
+            {bucket_end[radix_byte(format, base + i*w, depth)]++;}
+        if (bucket_end[radix_byte(format, base, depth)] != count)
+            {break;}
+    }
+    if (depth >= total)
+        {return 0;}
+    // counts become where each bucket ends and starts
+    j = 0;
+    for (b=0; b<256; b++)
+    {
+        next[b] = j;
+        j += bucket_end[b];
+        bucket_end[b] = j;
+    }
+    // american flag sort, swap every record into its bucket
+    for (b=0; b<256; b++)
+    {
+        while (next[b] < bucket_end[b])
+        {
+            c = radix_byte(format, base + next[b]*w, depth);
+            if (c == b)
+                {next[b]++; continue;}
+            swap_records(format, base + next[b]*w, base + next[c]*w, temp);
+            next[c]++;
+        }
+    }
+    j = 0;
+    for (b=0; b<256; b++)
+    {
+        radix_sort(format, base + j*w, bucket_end[b] - j, depth+1, temp);
+        j = bucket_end[b];
+    }
+    return 0;
+}
+
+static int64_t stash_size(recordFormat* format, int length)
+// presort buffer space for one line or record
+// RECORD_FIXED is packed bare for radix_sort(), the rest as in pack_record()
+{
+    if (format->mode == RECORD_FIXED)
+        {return length;}
+    return sizeof(int) + length + 1;
+}
+
+static char* stash_record(recordFormat* format, char* buffer, char* str, int length)
+// copies into the presort buffer, returns what qsort() should see
+{
+    if (format->mode == RECORD_FIXED)
+        {memcpy(buffer, str, length); return buffer;}
+    return pack_record(buffer, str, length);
+}
+
+static int presort_init(presortBucket* ps, miscBucket* misc)
+{
+    // largest malloc, most likely to OOM
+    ps->buffer_len = misc->presort_bytes;
+    ps->buffer = malloc(sizeof(char) * (ps->buffer_len+1));
+    ps->strings_len = 1024;
+    ps->strings = malloc(sizeof(char*) * (ps->strings_len+1));
+    ps->temp = malloc(misc->format->width + 1);
+    if (ps->buffer == NULL || ps->strings == NULL || ps->temp == NULL)
+        {return 1;}
+    ps->format = misc->format;
+    ps->strings_i = 0;
+    ps->buf_i = 0;
+    ps->log_i = 0;
+    ps->offset = 0;
+    misc->log_len = 1024;
+    misc->line_log = NULL;
+    misc->byte_log = NULL;
+    misc->first_log = NULL;
+    misc->last_log = NULL;
+    return grow_logs(misc, 0);
+}
+
+static int presort_free(presortBucket* ps)
+{
+    free(ps->buffer);
+    free(ps->strings);
+    free(ps->temp);
+    return 0;
+}
+
+static int presort_add(presortBucket* ps, miscBucket* misc, char* str, int length)
+// returns 1 if the buffer is full, presort_flush() and add it again
+// -1 if out of memory
+{
+    char* buffer;
+    char** strings;
+    int64_t size = stash_size(ps->format, length);
+    if (ps->buf_i > 0 && ps->buf_i + size >= misc->presort_bytes)
+        {return 1;}
+    // a lone record bigger than the buffer gets a buffer of its own
+    if (size >= ps->buffer_len)
+    {
+        fprintf(stderr, "WARNING: buffer too small\n");
+        ps->buffer_len = size + 1;
+        buffer = realloc(ps->buffer, ps->buffer_len + 1);
+        if (buffer == NULL)
+            {fprintf(stderr, "ERROR: memory\n"); return -1;}
+        ps->buffer = buffer;
+    }
+    // does strings have space for another pointer?
+    if (ps->format->mode != RECORD_FIXED && ps->strings_i+3 >= ps->strings_len)
+    {
+        strings = realloc(ps->strings, sizeof(char*) * (ps->strings_len*2 + 1));
+        if (strings == NULL)
+            {fprintf(stderr, "ERROR: memory\n"); return -1;}
+        ps->strings = strings;
+        ps->strings_len *= 2;
+    }
+    str = stash_record(ps->format, ps->buffer + ps->buf_i, str, length);
+    if (ps->format->mode != RECORD_FIXED)
+        {ps->strings[ps->strings_i] = str;}
+    ps->buf_i += size;
+    ps->strings_i++;
+    return 0;
+}
+
+static int presort_sort(presortBucket* ps)
+{
+    if (ps->format->mode == RECORD_FIXED)
+        {return radix_sort(ps->format, ps->buffer, ps->strings_i, 0, ps->temp);}
+    qsort_r(ps->strings, ps->strings_i, sizeof(char*), qsort_compare, ps->format);
+    return 0;
+}
+
+static char* presort_record(presortBucket* ps, int64_t i, int* length)
+// the i'th record in the buffer
+{
+    if (ps->format->mode == RECORD_FIXED)
+    {
+        *length = ps->format->width;
+        return ps->buffer + i * ps->format->width;
+    }
+    *length = record_len(ps->strings[i]);
+    return ps->strings[i];
+}
+
+static int presort_flush(presortBucket* ps, gzBucket* out, miscBucket* misc)
+// sorts the buffer and writes it out as the next segment
+{
+    char* str;
+    int64_t i, end;
+    int64_t log_i = ps->log_i;
+    int length;
+    presort_sort(ps);
+    if (ps->strings_i > 0)
+    {
+        str = presort_record(ps, 0, &length);
+        set_bound(ps->format, &misc->first_log[log_i], str, length);
+        str = presort_record(ps, ps->strings_i-1, &length);
+        set_bound(ps->format, &misc->last_log[log_i], str, length);
+    }
+    if (ps->format->mode == RECORD_FIXED)
+    {
+        // already in order and framed, gzwrite() takes an unsigned int
+        for (i=0; i<ps->buf_i; i += CHUNK * 1024)
+            {gzwrite(out->f, ps->buffer + i, (ps->buf_i - i < CHUNK * 1024) ? ps->buf_i - i : CHUNK * 1024);}
+    }
+    else
+    {
+        for (i=0; i<ps->strings_i; i++)
+            {put_record(out, ps->strings[i], record_len(ps->strings[i]));}
+    }
+    out->line_counter += ps->strings_i;
+    end = finish_member_gz(out);
+    // save the line count
+    if (log_i+3 >= misc->log_len)
+    {
+        misc->log_len *= 2;
+        if (grow_logs(misc, log_i+1))
+            {return 1;}
+    }
+    misc->line_log[log_i] = ps->strings_i;
+    misc->byte_log[log_i] = end - ps->offset;
+    ps->offset = end;
+    ps->log_i++;
+    ps->strings_i = 0;
+    ps->buf_i = 0;
+    return 0;
+}
+
+static int presort_pass(gzBucket* in1, gzBucket* out, miscBucket* misc, char* line_gz(gzBucket*))
+// updates line_log with how many lines were processed
+// each segment is written as its own gzip member
+{
+    presortBucket ps;
+    char* str1;
+    int r;
+    in1->line_counter = 0;
+    if (presort_init(&ps, misc))
+        {return 1;}
+    while ((str1 = line_gz(in1)) != NULL)
+    {
+        r = presort_add(&ps, misc, str1, in1->str_len);
+        if (r < 0)
+            {return 1;}
+        if (r == 0)
+            {continue;}
+        // full, the loose str1 starts the next one
+        if (presort_flush(&ps, out, misc) || presort_add(&ps, misc, str1, in1->str_len) < 0)
+            {return 1;}
+    }
+    if (presort_flush(&ps, out, misc))
+        {return 1;}
+    presort_free(&ps);
+    return 0;
+}
+
+static int nway_chop_and_presort(char* in_path, char* out_path, threadBucket* t, miscBucket* misc)
+{
+    time_t start;
+    gzBucket in1;
+    gzBucket out;
+    start = time(NULL);
+    // set up the gz files
+    if (init_gz(&in1, in_path, "rb", misc->format))
+        {return 1;}
+    if (init_gz(&out, out_path, misc->temp_mode, misc->format))
+        {return 1;}
+    // set up the offsets
+    skip_lines_gz(&in1, NWAY_WINDOW * t->thread_index);
+    in1.subset_counter = NWAY_WINDOW;
+    in1.nway_lines = NWAY_WINDOW;
+    in1.nway_skips = NWAY_WINDOW * (misc->nway-1);
+    // do a normal presort
+    // except it needs nway_line_gz() instead of load_line_gz()
+    in1.line_counter = 0;
+    out.line_counter = 0;
+    if (presort_pass(&in1, &out, misc, &nway_line_gz) || in1.error)
+        {close_gz(&in1); close_gz(&out); return 1;}
+    //misc->total_lines = in1.line_counter + NWAY_WINDOW * t->thread_index;
+    misc->total_lines = out.line_counter;
+    // clean up
+    close_gz(&in1); close_gz(&out);
+    report_time(misc->log, start, "%s line count: %ld\n%s chop/presort",
+        misc->label, (long)out.line_counter, misc->label);
+    return 0;
+}
+
+static int first_pass(char* input_path, char* output_path, miscBucket* misc)
+// updates total_lines in misc
+{ 
+    gzBucket in1;
+    gzBucket in2;
+    gzBucket out;
+    time_t start;
+    if (init_all(&in1, &in2, &out, input_path, output_path, misc->temp_mode, misc->format))
+        {return 1;}
+    start = time(NULL);
+    in1.line_counter = 0;
+    if (presort_pass(&in1, &out, misc, &load_line_gz) || in1.error)
+        {close_gz(&in1); close_gz(&in2); close_gz(&out); return 1;}
+    misc->total_lines = in1.line_counter;
+    report_time(misc->log, start, "%s line count: %ld\n%s presort",
+        misc->label, (long)in1.line_counter, misc->label);
+    close_gz(&in1); close_gz(&in2); close_gz(&out);
+    return 0;
+}
+
+static int run_order(passBucket* below, int64_t i)
+// 1 if a segment pair can be copied as is, 2 if swapped, 0 if they overlap
+// or if their prefixes are too alike to tell
+{
+    boundKey* first = below->first_log;
+    boundKey* last = below->last_log;
+    int cmp;
+    // empty or missing segments overlap nothing
+    if (i+1 >= below->segments || !first[i].used || !first[i+1].used)
+        {return 1;}
+    if (bound_compare(&last[i], &first[i+1], &cmp) && cmp <= 0)
+        {return 1;}
+    if (bound_compare(&last[i+1], &first[i], &cmp) && cmp <= 0)
+        {return 2;}
+    return 0;
+}
+
+static int merge_keys(passBucket* below, int64_t i, passBucket* p, int64_t j)
+// moves the combined key range of a segment pair up a level
+// when two prefixes can not be told apart either one is as good
+{
+    boundKey* first = &below->first_log[i];
+    boundKey* last = &below->last_log[i];
+    int cmp;
+    if (i+1 < below->segments && below->first_log[i+1].used)
+    {
+        if (!first->used || (bound_compare(&below->first_log[i+1], first, &cmp) && cmp < 0))
+            {first = &below->first_log[i+1];}
+        if (!last->used || (bound_compare(&below->last_log[i+1], last, &cmp) && cmp > 0))
+            {last = &below->last_log[i+1];}
+    }
+    p->first_log[j] = *first;
+    p->last_log[j] = *last;
+    return 0;
+}
+
+static int wait_segments(passBucket* below, int64_t needed)
+// blocks until the level below has written that many segments
+{
+    pthread_mutex_lock(below->lock);
+    while (below->done < needed)
+        {pthread_cond_wait(below->cond, below->lock);}
+    pthread_mutex_unlock(below->lock);
+    return 0;
+}
+
+static int segment_done(passBucket* p)
+// publishes a segment, then waits if the level above has fallen behind
+{
+    pthread_mutex_lock(p->lock);
+    p->done++;
+    pthread_cond_broadcast(p->cond);
+    while (p->done - p->consumed > PASS_AHEAD)
+        {pthread_cond_wait(p->cond, p->lock);}
+    pthread_mutex_unlock(p->lock);
+    return 0;
+}
+
+static int segments_consumed(passBucket* below, int64_t count, int fd, int64_t offset)
+// everything before offset has been merged and is no longer needed
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // keeps disk use near one copy while every level is in flight
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, offset);
+#else
+    (void)fd; (void)offset;
+#endif
+    pthread_mutex_lock(below->lock);
+    below->consumed = count;
+    pthread_cond_broadcast(below->cond);
+    pthread_mutex_unlock(below->lock);
+    return 0;
+}
+
+static int merge_pass(passBucket* below, passBucket* p)
+// merges pairs of segments from below as soon as they are written
+{
+    gzBucket in1;
+    gzBucket in2;
+    gzBucket out;
+    char* str1;
+    char* str2;
+    char* str3;
+    int cmp, order, len3;
+    int64_t i, j, size1, size2, bytes1, bytes2, offset, line_offset, mark, end;
+    offset = 0;
+    line_offset = 0;
+    mark = 0;
+    if (init_gz(&out, p->path, p->mode, p->misc->format))
+        {return 1;}
+    // below has not necessarily created its file yet
+    wait_segments(below, 1);
+    if (init_segment_gz(&in1, below->path, below->misc->format) || init_segment_gz(&in2, below->path, below->misc->format))
+        {return 1;}
+    out.line_counter = 0;
+    for (j=0; j < p->segments; j++)
+    {
+        i = j * 2;
+        wait_segments(below, (i+2 < below->segments) ? i+2 : below->segments);
+        size1 = below->line_log[i];
+        bytes1 = below->byte_log[i];
+        size2 = 0;
+        bytes2 = 0;
+        if (i+1 < below->segments)
+        {
+            size2 = below->line_log[i+1];
+            bytes2 = below->byte_log[i+1];
+        }
+        // unique still has to look at every line
+        order = p->unique ? 0 : run_order(below, i);
+        if (order == 1)
+        {
+            if (copy_bytes(in1.fd, offset, bytes1, &out) ||
+                copy_bytes(in1.fd, offset+bytes1, bytes2, &out))
+                {return 1;}
+        }
+        if (order == 2)
+        {
+            if (copy_bytes(in1.fd, offset+bytes1, bytes2, &out) ||
+                copy_bytes(in1.fd, offset, bytes1, &out))
+                {return 1;}
+        }
+        if (order != 0)
+            {out.line_counter += size1 + size2;}
+        str1 = NULL;
+        str2 = NULL;
+        if (order == 0)
+        {
+            seek_gz(&in1, offset, offset+bytes1, line_offset);
+            seek_gz(&in2, offset+bytes1, offset+bytes1+bytes2, line_offset+size1);
+            in1.subset_counter = size1;
+            in2.subset_counter = size2;
+            str1 = subset_lines_gz(&in1);
+            str2 = subset_lines_gz(&in2);
+        }
+        while (str1!=NULL || str2!=NULL)
+        {
+            cmp = 0;
+            // normal merge sort, chip away at either
+            if (str1!=NULL && str2!=NULL)
+                {cmp = compare_records(p->misc->format, str1, in1.str_len, str2, in2.str_len);}
+            // one chunk is empty, pass the rest through
+            if (str1!=NULL && str2==NULL)
+                {cmp = -1;}
+            if (str1==NULL && str2!=NULL)
+                {cmp = 1;}
+            str3 = (cmp < 0) ? str1 : str2;
+            len3 = (cmp < 0) ? in1.str_len : in2.str_len;
+            if (!p->unique)
+            {
+                put_record(&out, str3, len3);
+                out.line_counter++;
+            }
+            else
+                {put_unique(&out, str3, len3);}
+            if (cmp < 0)
+                {str1 = subset_lines_gz(&in1);}
+            else
+                {str2 = subset_lines_gz(&in2);}
+        }
+        // a short or corrupt segment must not pass as merged
+        if (order == 0 && (in1.error || in2.error ||
+            in1.line_counter != line_offset + size1 ||
+            in2.line_counter != line_offset + size1 + size2))
+        {
+            fprintf(stderr, "ERROR: segment %ld of %s ended early\n", (long)i, below->path);
+            close_gz(&in1); close_gz(&in2); close_gz(&out);
+            return 1;
+        }
+        end = finish_member_gz(&out);
+        p->line_log[j] = size1 + size2;
+        p->byte_log[j] = end - mark;
+        merge_keys(below, i, p, j);
+        mark = end;
+        offset += bytes1 + bytes2;
+        line_offset += size1 + size2;
+        segments_consumed(below, i+2, in1.fd, offset);
+        segment_done(p);
+    }
+    p->line_counter = out.line_counter;
+    close_gz(&in1); close_gz(&in2); close_gz(&out);
+    return 0;
+}
+
+static void* pass_thread_fn(void* arg)
+{
+    passBucket* p = arg;
+    passBucket* below = p - 1;  // levels live in one array
+    time_t start;
+    start = time(NULL);
+    p->status = merge_pass(below, p);
+    if (p->status)
+    {
+        // unblock the neighbours so that everyone can exit
+        pthread_mutex_lock(p->lock);
+        p->done = p->segments;
+        below->consumed = below->segments;
+        pthread_cond_broadcast(p->cond);
+        pthread_mutex_unlock(p->lock);
+    }
+    unlink(below->path);
+    report_time(p->misc->log, start, "%s merge %ld", p->misc->label,
+        (long)(p->misc->total_lines / below->segments));
+    return NULL;
+}
+
+static int free_level(passBucket* p)
+{
+    free(p->line_log);
+    free(p->byte_log);
+    free(p->first_log);
+    free(p->last_log);
+    return 0;
+}
+
+static int middle_passes(char* input_path, char* output_path, miscBucket* misc)
+// every level of the merge tree runs at once
+// each one consumes segment pairs as soon as the level below writes them
+// leaves the result in output_path and removes input_path
+{
+    passBucket* levels;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int64_t segments;
+    int depth, k, r;
+    int status = 0;
+    segments = 0;
+    while (misc->line_log[segments] != -1)
+        {segments++;}
+    // a single buffer still gets one busywork merge
+    depth = 1;
+    while (((int64_t)1 << depth) < segments)
+        {depth++;}
+    levels = calloc(depth + 1, sizeof(passBucket));
+    if (levels == NULL)
+        {return 1;}
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+    // the presorted file is already complete
+    levels[0].path = input_path;
+    levels[0].segments = segments;
+    levels[0].done = segments;
+    levels[0].line_log = misc->line_log;
+    levels[0].byte_log = misc->byte_log;
+    levels[0].first_log = misc->first_log;
+    levels[0].last_log = misc->last_log;
+    for (k=0; k <= depth; k++)
+    {
+        levels[k].misc = misc;
+        levels[k].lock = &lock;
+        levels[k].cond = &cond;
+        if (k == 0)
+            {continue;}
+        segments = (segments + 1) / 2;
+        levels[k].segments = segments;
+        levels[k].unique = (k == depth) ? misc->unique : 0;
+        levels[k].mode = (k == depth) ? misc->out_mode : misc->temp_mode;
+        if (k == depth)
+            {levels[k].path = output_path;}
+        else
+        {
+            r = asprintf(&levels[k].path, "%s.%i", input_path, k);
+            MEMCHECK;
+        }
+        levels[k].line_log = calloc(segments + 1, sizeof(int64_t));
+        levels[k].byte_log = calloc(segments + 1, sizeof(int64_t));
+        levels[k].first_log = calloc(segments + 1, sizeof(boundKey));
+        levels[k].last_log = calloc(segments + 1, sizeof(boundKey));
+        if (!levels[k].line_log || !levels[k].byte_log || !levels[k].first_log || !levels[k].last_log)
+            {return 1;}
+    }
+    for (k=1; k <= depth; k++)
+        {pthread_create(&levels[k].pass_thread, NULL, pass_thread_fn, (void *)(&levels[k]));}
+    for (k=1; k <= depth; k++)
+    {
+        pthread_join(levels[k].pass_thread, NULL);
+        status |= levels[k].status;
+    }
+    if (misc->unique)
+        {log_printf(misc->log, "removed %ld non-unique lines\n",
+            (long)(misc->total_lines - levels[depth].line_counter));}
+    for (k=0; k <= depth; k++)
+    {
+        free_level(&levels[k]);
+        if (k > 0 && k < depth)
+            {free(levels[k].path);}
+    }
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&cond);
+    free(levels);
+    return status;
+}
+
+#define heap_parent(x) ((x-1) / 2)
+#define heap_child1(x) (x*2 + 1)
+#define heap_child2(x) (x*2 + 2)
+
+static int heap_add(recordFormat* format, heapItem heap[], char* str, int len, int source, int heap_tail)
+// manually increment the tail afterwards
+{
+    int p, c;
+    heapItem item;
+    item.str = str;
+    item.len = len;
+    item.source = source;
+    c = heap_tail;
+    while (c > 0)
+    {
+        p = heap_parent(c);
+        if (compare_records(format, heap[p].str, heap[p].len, str, len) <= 0)
+            {break;}
+        // move it up
+        heap[c] = heap[p];
+        c = p;
+    }
+    heap[c] = item;
+    return 0;
+}
+
+static int heap_sift(recordFormat* format, heapItem heap[], int heap_tail)
+// the top was replaced, push it down to where it belongs
+{
+    int p, c, c2;
+    heapItem item = heap[0];
+    p = 0;
+    while (1)
+    {
+        c = heap_child1(p);
+        c2 = heap_child2(p);
+        if (c >= heap_tail)
+            {break;}
+        if (c2 < heap_tail && compare_records(format, heap[c].str, heap[c].len, heap[c2].str, heap[c2].len) > 0)
+            {c = c2;}
+        if (compare_records(format, item.str, item.len, heap[c].str, heap[c].len) <= 0)
+            {break;}
+        // move it down
+        heap[p] = heap[c];
+        p = c;
+    }
+    heap[p] = item;
+    return 0;
+}
+
+static int heap_pop(recordFormat* format, heapItem heap[], int heap_tail)
+// manually decrement the tail afterwards
+{
+    heap[0] = heap[heap_tail - 1];
+    return heap_sift(format, heap, heap_tail - 1);
+}
+
+static int heap_replace(recordFormat* format, heapItem heap[], char* str, int len, int heap_tail)
+// swap a new string in for the top, from the same source
+// one sift instead of a pop and an add
+{
+    heap[0].str = str;
+    heap[0].len = len;
+    return heap_sift(format, heap, heap_tail);
+}
+
+static int64_t nway_merge_pass(char** paths, int count, char* out_path, miscBucket* misc, int64_t* lines_read)
+// simpler version that merges fully sorted files
+// returns the number of lines written, or -1 on error
+{
+    heapItem* heap;
+    gzBucket* ins;
+    gzBucket out;
+    time_t start;
+    char* str;
+    int i, heap_tail;
+    heap_tail = 0;
+    *lines_read = 0;
+    start = time(NULL);
+    heap = malloc(sizeof(heapItem) * (count+1));
+    ins = malloc(sizeof(gzBucket) * count);
+    if (heap == NULL || ins == NULL)
+        {return -1;}
+    // set up all the files
+    if (init_gz(&out, out_path, "wb", misc->format))
+        {return -1;}
+    out.line_counter = 0;
+    for (i=0; i<count; i++)
+    {
+        if (init_gz(&ins[i], paths[i], "rb", misc->format))
+            {return -1;}
+    }
+    // seed the heap
+    for (i=0; i<count; i++)
+    {
+        str = load_line_gz(&ins[i]);
+        if (str != NULL)
+            {heap_add(misc->format, heap, str, ins[i].str_len, i, heap_tail++);}
+    }
+    while (heap_tail > 0)
+    {
+        if (!misc->unique)
+        {
+            put_record(&out, heap[0].str, heap[0].len);
+            out.line_counter++;
+        }
+        else
+            {put_unique(&out, heap[0].str, heap[0].len);}
+        // refill from the same source
+        i = heap[0].source;
+        str = load_line_gz(&ins[i]);
+        if (str == NULL)
+            {heap_pop(misc->format, heap, heap_tail--);}
+        else
+            {heap_replace(misc->format, heap, str, ins[i].str_len, heap_tail);}
+    }
+
+    report_time(misc->log, start, "%i-way merge", count);
+    // clean up all the files
+    close_gz(&out);
+    for (i=0; i<count; i++)
+    {
+        *lines_read += ins[i].line_counter;
+        if (ins[i].error)
+            {out.line_counter = -1;}
+        close_gz(&ins[i]);
+    }
+    free(ins);
+    free(heap);
+    return out.line_counter;
+}
+
+static int merge_fanin(void)
+// how many files one nway_merge_pass may hold open
+{
+    struct rlimit rl;
+    int64_t fanin = MAX_FANIN;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+    {
+        if ((int64_t)rl.rlim_cur - SPARE_FILES < fanin)
+            {fanin = (int64_t)rl.rlim_cur - SPARE_FILES;}
+    }
+    if (fanin < 2)
+        {fanin = 2;}
+    return (int)fanin;
+}
+
+static int cascade_merge(char** paths, int count, char* out_path, miscBucket* misc)
+// merges any number of sorted files
+// too many to open at once are merged in a tree of temp files
+{
+    char** level;
+    char** next;
+    int fanin, groups, depth, i, offset, size, r;
+    int64_t lines_read, written;
+    int64_t total_lines = 0;
+    fanin = merge_fanin();
+    level = paths;
+    depth = 0;
+    while (count > fanin)
+    {
+        groups = (count + fanin - 1) / fanin;
+        next = malloc(sizeof(char*) * groups);
+        if (next == NULL)
+            {return 1;}
+        offset = 0;
+        for (i=0; i<groups; i++)
+        {
+            // spread the files evenly over the groups
+            size = (count - offset) / (groups - i);
+            r = asprintf(&next[i], "%s.M%i.%i.temp", out_path, depth, i);
+            MEMCHECK;
+            // uniqueness is safe to apply early and shrinks the next level
+            written = nway_merge_pass(level+offset, size, next[i], misc, &lines_read);
+            if (written < 0)
+                {return 1;}
+            if (depth == 0)
+                {total_lines += lines_read;}
+            offset += size;
+        }
+        if (depth > 0)
+        {
+            for (i=0; i<count; i++)
+                {unlink(level[i]); free(level[i]);}
+            free(level);
+        }
+        level = next;
+        count = groups;
+        depth++;
+    }
+    written = nway_merge_pass(level, count, out_path, misc, &lines_read);
+    if (written < 0)
+        {return 1;}
+    if (depth == 0)
+        {total_lines = lines_read;}
+    else
+    {
+        for (i=0; i<count; i++)
+            {unlink(level[i]); free(level[i]);}
+        free(level);
+    }
+    misc->total_lines = total_lines;
+    if (misc->unique)
+        {log_printf(misc->log, "removed %ld non-unique lines\n",
+            (long)(total_lines - written));}
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int64_t ceil_log2(int64_t x)
+{
+    int64_t n = 0;
+    while (((int64_t)1 << n) < x)
+        {n++;}
+    return n;
+}
+
+static int sample_compare(const void* a, const void* b)
+// the sample is bare lines, see plan_sort()
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static double copy_fraction(char** lines, int64_t count, int64_t seg)
+// share of segment pairs that merge_pass() could copy without inflating
+{
+    int64_t i, j, pairs, copies;
+    char* lo[2];
+    char* hi[2];
+    if (seg > count / 4)
+        {seg = count / 4;}
+    if (seg < 1)
+        {return 0;}
+    pairs = 0;
+    copies = 0;
+    for (i=0; i + 2*seg <= count; i += 2*seg)
+    {
+        for (j=0; j < 2*seg; j++)
+        {
+            if (j % seg == 0 || strcmp(lines[i+j], lo[j/seg]) < 0)
+                {lo[j/seg] = lines[i+j];}
+            if (j % seg == 0 || strcmp(lines[i+j], hi[j/seg]) > 0)
+                {hi[j/seg] = lines[i+j];}
+        }
+        pairs++;
+        if (strcmp(hi[0], lo[1]) <= 0 || strcmp(hi[1], lo[0]) <= 0)
+            {copies++;}
+    }
+    if (pairs == 0)
+        {return 0;}
+    return (double)copies / pairs;
+}
+
+static int plan_sort(char* input_path, miscBucket* misc, int fixed_size, int fixed_threads)
+// samples the head of the source and picks -S, -P and the temp gzip level
+// for the lowest predicted time that fits in misc->disk_cap
+{
+    gzBucket in1;
+    struct stat st;
+    char* sample;
+    char** lines;
+    char* str1;
+    unsigned char* packed;
+    uLongf packed_len;
+    int levels[2] = {1, Z_DEFAULT_COMPRESSION};
+    int64_t bytes, count, size, in_order, budget, total, total_lines, line_len;
+    int64_t seg, runs, passes, disk, best_disk, best_passes;
+    int64_t i, len, temp_bytes[2];
+    double t_inflate, t_deflate[2], t_sort, copy, cpu, merge, wall, best;
+    double t0;
+    int cores, threads, level, best_threads, best_level, lanes;
+    if (stat(input_path, &st))
+        {fprintf(stderr, "ERROR: could not stat %s\n", input_path); return 1;}
+    if (init_gz(&in1, input_path, "rb", misc->format))
+        {return 1;}
+    sample = malloc(SAMPLE_BYTES + 1);
+    size = 1024;
+    lines = malloc(sizeof(char*) * size);
+    if (sample == NULL || lines == NULL)
+        {return 1;}
+    bytes = 0;
+    count = 0;
+    in_order = 0;
+    // inflate speed, line length and how sorted it already is
+    t0 = now();
+    while ((str1 = load_line_gz(&in1)) != NULL)
+    {
+        len = strlen(str1);
+        if (bytes + len + 1 > SAMPLE_BYTES)
+            {break;}
+        memcpy(sample + bytes, str1, len + 1);
+        if (count == size)
+        {
+            size *= 2;
+            lines = realloc(lines, sizeof(char*) * size);
+        }
+        lines[count] = sample + bytes;
+        if (count && strcmp(lines[count-1], lines[count]) <= 0)
+            {in_order++;}
+        bytes += len + 1;
+        count++;
+    }
+    t_inflate = (now() - t0) / (bytes + 1);
+    if (str1 == NULL)
+        {total = bytes;}
+    else
+        {total = (double)st.st_size * bytes / (gzoffset(in1.f) + 1);}
+    close_gz(&in1);
+    if (count < 2)
+        {fprintf(stderr, "WARNING: nothing to plan\n"); return 0;}
+    line_len = bytes / count;
+    total_lines = (double)total * count / bytes;
+    // deflate speed and size at each temp level
+    for (i=0; i<bytes; i++)
+        {if (sample[i] == '\0') {sample[i] = '\n';}}
+    packed_len = compressBound(bytes);
+    packed = malloc(packed_len);
+    if (packed == NULL)
+        {return 1;}
+    for (level=0; level<2; level++)
+    {
+        packed_len = compressBound(bytes);
+        t0 = now();
+        compress2(packed, &packed_len, (unsigned char*)sample, bytes, levels[level]);
+        t_deflate[level] = (now() - t0) / bytes;
+        temp_bytes[level] = (double)total * packed_len / bytes;
+    }
+    free(packed);
+    for (i=0; i<bytes; i++)
+        {if (sample[i] == '\n') {sample[i] = '\0';}}
+    // presort cost per line per comparison
+    t0 = now();
+    qsort(lines, count, sizeof(char*), sample_compare);
+    t_sort = (now() - t0) / (count * (ceil_log2(count) + 1));
+    // the segments have to be read in file order again
+    count = 0;
+    for (i=0; i<bytes; i += strlen(sample + i) + 1)
+        {lines[count++] = sample + i;}
+
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+        {cores = 1;}
+    if (cores > MAX_THREADS)
+        {cores = MAX_THREADS;}
+    budget = misc->presort_bytes;
+    if (!fixed_size)
+    {
+        // a quarter of ram, but no more than it takes to hold everything
+        budget = (int64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 4;
+        if (budget > total * 2 + PRESORT_WINDOW)
+            {budget = total * 2 + PRESORT_WINDOW;}
+        if (budget < PRESORT_WINDOW)
+            {budget = PRESORT_WINDOW;}
+    }
+    best = -1;
+    best_threads = 0;
+    best_level = 1;
+    best_disk = 0;
+    best_passes = 0;
+    copy = 0;
+    for (threads = 0; threads <= (fixed_threads ? misc->nway : cores); threads++)
+    {
+        if (fixed_threads ? threads != misc->nway : threads == 1)
+            {continue;}
+        // same arithmetic as main() uses on presort_bytes
+        size = budget / (threads ? threads : 1) / 2;
+        // a tiny -S still holds a line per presort
+        if (size < line_len)
+            {size = line_len;}
+        seg = size / line_len + 1;
+        runs = total / (threads ? threads : 1) / size + 1;
+        passes = ceil_log2(runs);
+        if (passes < 1)
+            {passes = 1;}
+        copy = copy_fraction(lines, count, seg);
+        // merge levels run at once, on whatever cores each thread gets
+        lanes = cores / (threads ? threads : 1);
+        if (lanes < 1)
+            {lanes = 1;}
+        if (lanes > passes)
+            {lanes = passes;}
+        for (level=0; level<2; level++)
+        {
+            // one level being read, one being written, plus -P outputs
+            disk = temp_bytes[level] * 2;
+            if (threads)
+                {disk += temp_bytes[level];}
+            if (misc->disk_cap && disk > misc->disk_cap)
+                {continue;}
+            cpu = total * t_inflate * (threads ? threads : 1);
+            cpu += total * t_deflate[level];
+            cpu += total_lines * t_sort * ceil_log2(seg);
+            merge = total * (1 - copy) * (t_inflate + t_deflate[level]) * passes;
+            if (threads)
+            {
+                // the chop inflates everything in every thread
+                wall = total * t_inflate + (cpu - total * t_inflate * threads) / threads;
+                wall += merge / threads / lanes;
+                wall += total * (t_inflate + t_deflate[1]);
+            }
+            else
+                {wall = cpu + merge / lanes;}
+            if (best < 0 || wall < best)
+            {
+                best = wall;
+                best_threads = threads;
+                best_level = levels[level];
+                best_disk = disk;
+                best_passes = passes;
+            }
+        }
+    }
+    log_printf(misc->log, "plan: sampled %ld lines, %.1fx compression, %ld bytes/line, %.1f%% in order\n",
+        (long)count, (double)total / st.st_size, (long)line_len, 100.0 * in_order / (count - 1));
+    log_printf(misc->log, "plan: about %.1f MB and %ld lines uncompressed\n",
+        total / 1e6, (long)total_lines);
+    free(sample);
+    free(lines);
+    if (best < 0)
+    {
+        fprintf(stderr, "ERROR: no plan fits in %.1f MB of disk\n", misc->disk_cap / 1e6);
+        return 1;
+    }
+    misc->presort_bytes = budget;
+    misc->nway = best_threads;
+    misc->temp_mode = (best_level == 1) ? "wb1" : "wb";
+    log_printf(misc->log, "plan: -S %ldk -P %i, %ld merge passes, temp gzip level %i\n",
+        (long)(budget / 1000), best_threads, (long)best_passes, best_level == 1 ? 1 : 6);
+    if (best < 100)
+        {log_printf(misc->log, "plan: about %.1f MB of temp disk, about %.0f seconds\n",
+            best_disk / 1e6, best);}
+    else
+        {log_printf(misc->log, "plan: about %.1f MB of temp disk, about %.1f minutes\n",
+            best_disk / 1e6, best / 60);}
+    return 0;
+}
+
+#ifndef NO_AFFINITY
+static int read_cpulist(char* path, cpu_set_t* set)
+// parses sysfs lists like "0-3,8-11", returns 1 if unreadable
+{
+    FILE* f;
+    int a, b, sep;
+    CPU_ZERO(set);
+    if (!(f = fopen(path, "r")))
+        {return 1;}
+    while (fscanf(f, "%i", &a) == 1)
+    {
+        b = a;
+        sep = fgetc(f);
+        if (sep == '-')
+        {
+            if (fscanf(f, "%i", &b) != 1)
+                {break;}
+            sep = fgetc(f);
+        }
+        for (; a <= b && a < CPU_SETSIZE; a++)
+            {CPU_SET(a, set);}
+        if (sep != ',')
+            {break;}
+    }
+    fclose(f);
+    return 0;
+}
+
+static int numa_nodes(cpu_set_t nodes[], cpu_set_t* allowed)
+// fills in the usable cpus of each node, returns how many nodes
+{
+    char* path;
+    int n, count, r;
+    count = 0;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), allowed))
+        {return 0;}
+    for (n=0; n < MAX_NODES; n++)
+    {
+        r = asprintf(&path, "/sys/devices/system/node/node%i/cpulist", n);
+        if (r < 0)
+            {return 0;}
+        r = read_cpulist(path, &nodes[count]);
+        free(path);
+        if (r)
+            {continue;}
+        CPU_AND(&nodes[count], &nodes[count], allowed);
+        if (CPU_COUNT(&nodes[count]))
+            {count++;}
+    }
+    return count;
+}
+
+static int place_thread(pthread_attr_t* attr, cpu_set_t nodes[], int count, int index)
+// spreads the -P threads over the NUMA nodes from numa_nodes()
+// a pinned thread first touches its presort buffer, so the kernel
+// allocates it on the local node, and its merge threads inherit the pin
+// with one node there is nothing to gain and the merges need every cpu
+{
+    if (count < 2)
+        {return 0;}
+    return pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &nodes[index % count]);
+}
+#endif
+
+static void* sort_thread_fn(void* arg)
+// problem, can't modify misc...
+{
+    threadBucket* t = arg;
+    miscBucket* misc = &(t->misc);
+    char* temp_path = t->in_path;
+    char* output_path = t->out_path;
+    misc->total_lines = 0;
+    misc->label = t->label;
+
+    // first pass is a doozy
+    t->status = nway_chop_and_presort(t->source_path, temp_path, t, misc);
+    if (t->status)
+        {return NULL;}
+
+    // merge sort everything
+    t->status = middle_passes(temp_path, output_path, misc);
+
+    return NULL;
+}
+
+static int apply_options(gzsortOptions* options, miscBucket* misc, recordFormat* format)
+// fills misc and the record format from the public options
+{
+    if (options->key_len && options->record_mode == RECORD_TEXT)
+        {fprintf(stderr, "ERROR: -K needs -R or -V\n"); return 1;}
+    if (options->record_mode == RECORD_FIXED && options->record_width <= 0)
+        {fprintf(stderr, "ERROR: -R needs a width\n"); return 1;}
+    if (options->record_mode == RECORD_FIXED &&
+        options->key_start + options->key_len > options->record_width)
+        {fprintf(stderr, "ERROR: -K is past the end of the record\n"); return 1;}
+    format->mode = options->record_mode;
+    format->width = (format->mode == RECORD_FIXED) ? options->record_width : 0;
+    format->key_start = options->key_start;
+    format->key_len = options->key_len;
+    misc->format = format;
+    misc->log = options->log;
+    misc->label = "";
+    misc->total_lines = 0;
+    misc->presort_bytes = options->presort_bytes ? options->presort_bytes : PRESORT_WINDOW;
+    misc->line_log = NULL;
+    misc->byte_log = NULL;
+    misc->first_log = NULL;
+    misc->last_log = NULL;
+    misc->log_len = 0;
+    misc->pass_through = options->pass_through;
+    misc->unique = options->unique;
+    misc->nway = (options->threads > 0) ? options->threads : 0;
+    if (misc->nway > MAX_THREADS)
+        {misc->nway = MAX_THREADS;}
+    misc->affinity = options->affinity;
+    misc->limit = options->limit;
+    misc->disk_cap = options->disk_cap;
+    misc->temp_mode = "wb";
+    misc->out_mode = "wb";
+    return 0;
+}
+
+static int fudge_presort(miscBucket* misc)
+// fudge factor, suspected PEBCAK
+{
+    if (misc->presort_bytes < 1e9)
+        {misc->presort_bytes /= 2;}
+    else
+        {misc->presort_bytes -= 0.5e9;}
+    return 0;
+}
+
+int gzsort_options(gzsortOptions* options)
+// the same defaults as the command line
+{
+    memset(options, 0, sizeof(gzsortOptions));
+    options->threads = -1;
+    return 0;
+}
+
+int gzsort_merge(gzsortOptions* options, char** paths, int count, char* output_path)
+{
+    miscBucket misc;
+    recordFormat format;
+    if (options->limit)
+        {fprintf(stderr, "ERROR: -L does not work with -m\n"); return 1;}
+    if (apply_options(options, &misc, &format))
+        {return 1;}
+    return cascade_merge(paths, count, output_path, &misc);
+}
+
+int gzsort_file(gzsortOptions* options, char* input_path, char* output_path)
+{
+    miscBucket misc;
+    recordFormat format;
+    threadBucket nway_table[MAX_THREADS];
+    char* temp_path;
+    char* merge_paths[MAX_THREADS];
+    pthread_attr_t attr;
+#ifndef NO_AFFINITY
+    cpu_set_t nodes[MAX_NODES];
+    cpu_set_t allowed;
+    int node_count = 0;
+#endif
+    int i, r;
+    int status = 0;
+    int plan = options->estimate;
+    int64_t lines_read, lines_written;
+    if (options->limit && (options->threads > 0 || options->estimate))
+        {fprintf(stderr, "ERROR: -L does not work with -P or -E\n"); return 1;}
+    if (apply_options(options, &misc, &format))
+        {return 1;}
+    if (plan && format.mode != RECORD_TEXT)
+    {
+        fprintf(stderr, "WARNING: -E only samples lines, ignored\n");
+        plan = 0;
+    }
+    if (plan && !misc.pass_through && !misc.limit)
+    {
+        if (plan_sort(input_path, &misc, options->presort_bytes != 0, options->threads >= 0))
+            {return 1;}
+    }
+    if (misc.nway)
+        {misc.presort_bytes /= misc.nway;}
+    fudge_presort(&misc);
+
+    // debug mode
+    if (misc.pass_through)
+        {return pass_through_pass(input_path, output_path, &misc);}
+
+    // top of the sort, no temp files
+    if (misc.limit)
+        {return limit_pass(input_path, output_path, &misc);}
+
+    // simple un-threaded sort
+    if (!misc.nway)
+    {
+        r = asprintf(&temp_path, "%s.temp", output_path);
+        MEMCHECK;
+        if (first_pass(input_path, output_path, &misc))
+            {unlink(output_path); free(temp_path); return 1;}
+        rename(output_path, temp_path);
+
+        r = middle_passes(temp_path, output_path, &misc);
+        free(temp_path);
+        return r;
+    }
+    // multi thread sort
+    // set up the data for each process
+    for (i=0; i < misc.nway; i++)
+    {
+        nway_table[i].misc.nway = misc.nway;
+        nway_table[i].misc.presort_bytes = misc.presort_bytes;
+        nway_table[i].misc.unique = 0;
+        nway_table[i].misc.format = &format;
+        nway_table[i].misc.log = misc.log;
+        nway_table[i].misc.temp_mode = misc.temp_mode;
+        nway_table[i].misc.out_mode = misc.temp_mode;
+        nway_table[i].thread_index = i;
+        nway_table[i].status = 0;
+        nway_table[i].source_path = input_path;
+        r = asprintf(&(nway_table[i].label), "T%i", i+1);
+        MEMCHECK;
+        r = asprintf(&(nway_table[i].in_path), "%s.T%i.temp", output_path, i+1);
+        MEMCHECK;
+        r = asprintf(&(nway_table[i].out_path), "%s.T%i.gz",  output_path, i+1);
+        MEMCHECK;
+    }
+    // run all the sorts
+#ifndef NO_AFFINITY
+    if (misc.affinity)
+        {node_count = numa_nodes(nodes, &allowed);}
+#endif
+    for (i=0; i < misc.nway; i++)
+    {
+        // combined chop, presort and extra middle_pass
+        pthread_attr_init(&attr);
+#ifndef NO_AFFINITY
+        if (misc.affinity && place_thread(&attr, nodes, node_count, i))
+            {fprintf(stderr, "WARNING: could not pin T%i\n", i+1);}
+#endif
+        pthread_create(&nway_table[i].sort_thread, &attr, sort_thread_fn, (void *)(&nway_table[i]));
+        pthread_attr_destroy(&attr);
+        //sort_thread_fn((void *)(&nway_table[i]));
+    }
+    // wait for threads, merge everything and clean up
+    for (i=0; i < misc.nway; i++)
+    {
+        if (nway_table[i].sort_thread)
+            {pthread_join(nway_table[i].sort_thread, NULL);}
+        unlink(nway_table[i].in_path);
+        merge_paths[i] = nway_table[i].out_path;
+        status |= nway_table[i].status;
+    }
+    // a failed thread would leave a hole in the output
+    if (!status)
+    {
+        lines_written = nway_merge_pass(merge_paths, misc.nway, output_path, &misc, &lines_read);
+        status = lines_written < 0;
+    }
+    if (!status && misc.unique)
+    {
+        lines_read = 0;
+        for (i=0; i < misc.nway; i++)
+            {lines_read += nway_table[i].misc.total_lines;}
+        log_printf(misc.log, "removed %ld non-unique lines\n",
+            (long)(lines_read - lines_written));
+    }
+    for (i=0; i < misc.nway; i++)
+    {
+        free(nway_table[i].label);
+        free(nway_table[i].in_path);
+        unlink(nway_table[i].out_path);
+        free(nway_table[i].out_path);
+    }
+    return status;
+}
+
+struct sortBucket
+// a streaming sort, see gzsort.h
+{
+    miscBucket misc;
+    recordFormat format;
+    presortBucket presort;
+    limitBucket limit;   // instead of the presort with a limit, never spills
+    gzBucket temp;       // the spilled segments
+    gzBucket sorted;     // what gzsort_pull() reads after a spill
+    char* temp_path;
+    char* sorted_path;
+    int spilled;         // 1 while writing temp, 2 once sorted is open
+    int finished;
+    int status;
+    int64_t pushed;
+    int64_t pulled;
+    int64_t pull_i;      // the next record in ram, without a spill
+    char* last;          // for unique in ram
+    int last_len;
+    char* carry;         // the cut off record from gzsort_push_buffer()
+    int64_t carry_len;
+    int64_t carry_size;
+    char* frame;         // the record gzsort_pull_buffer() is copying out
+    int64_t frame_len;
+    int64_t frame_i;
+    int64_t frame_size;
+};
+
+gzsortBucket* gzsort_new(gzsortOptions* options)
+{
+    gzsortBucket* s;
+    char* dir;
+    int r;
+    s = calloc(1, sizeof(gzsortBucket));
+    if (s == NULL)
+        {return NULL;}
+    if (apply_options(options, &s->misc, &s->format))
+        {free(s); return NULL;}
+    fudge_presort(&s->misc);
+    // nobody else reads these, favor speed over size
+    s->misc.temp_mode = "wb1";
+    s->misc.out_mode = "wb1";
+    dir = options->temp_dir ? options->temp_dir : getenv("TMPDIR");
+    if (dir == NULL)
+        {dir = "/tmp";}
+    r = asprintf(&s->temp_path, "%s/gzsort.XXXXXX", dir);
+    if (r < 0)
+        {s->temp_path = NULL;}
+    if (r < 0)
+        {gzsort_free(s); return NULL;}
+    if (s->misc.limit ? limit_init(&s->limit, &s->misc) : presort_init(&s->presort, &s->misc))
+        {gzsort_free(s); return NULL;}
+    return s;
+}
+
+static int stream_spill(gzsortBucket* s)
+// the presort is full, the first spill creates the temp file
+{
+    int fd;
+    if (!s->spilled)
+    {
+        fd = mkstemp(s->temp_path);
+        if (fd < 0)
+        {
+            fprintf(stderr, "ERROR: could not create %s\n", s->temp_path);
+            return 1;
+        }
+        close(fd);
+        s->spilled = 1;
+        if (init_gz(&s->temp, s->temp_path, s->misc.temp_mode, &s->format))
+            {return 1;}
+        s->temp.line_counter = 0;
+    }
+    return presort_flush(&s->presort, &s->temp, &s->misc);
+}
+
+int gzsort_push(gzsortBucket* s, char* str, int length)
+{
+    int r;
+    if (s->finished || s->status)
+        {return 1;}
+    if (s->format.mode == RECORD_FIXED && length != s->format.width)
+    {
+        fprintf(stderr, "ERROR: record is not %i bytes\n", s->format.width);
+        return 1;
+    }
+    if (s->misc.limit)
+        {r = limit_add(&s->limit, str, length);}
+    else
+        {r = presort_add(&s->presort, &s->misc, str, length);}
+    if (r > 0 && !s->misc.limit)
+    {
+        // full, spill it and start over
+        r = stream_spill(s);
+        if (r == 0)
+            {r = presort_add(&s->presort, &s->misc, str, length);}
+    }
+    if (r)
+        {s->status = 1; return 1;}
+    s->pushed++;
+    return 0;
+}
+
+static int64_t frame_size(recordFormat* format, char* data, int64_t length, int64_t* header, int64_t* size)
+// finds the first record in data, returns its size along with the framing
+// 0 if it is cut off, -1 if it is garbage
+{
+    char* newline;
+    int r;
+    *header = 0;
+    if (format->mode == RECORD_TEXT)
+    {
+        newline = memchr(data, '\n', length);
+        if (newline == NULL)
+            {return 0;}
+        *size = newline - data;
+        return *size + 1;
+    }
+    if (format->mode == RECORD_FIXED)
+    {
+        *size = format->width;
+        return (length >= *size) ? *size : 0;
+    }
+    r = read_varint(data, length, header, size);
+    if (r < 0 || *size > INT32_MAX / 2)
+        {fprintf(stderr, "ERROR: bad record length\n"); return -1;}
+    if (r == 0 || *header + *size > length)
+        {return 0;}
+    return *header + *size;
+}
+
+static int64_t carry_need(gzsortBucket* s, char* data, int64_t length)
+// how much of data to add to the carry, so that it is one record at most
+{
+    char* newline;
+    int64_t header, size;
+    int64_t want = 1;
+    if (s->format.mode == RECORD_TEXT)
+    {
+        newline = memchr(data, '\n', length);
+        want = newline ? newline - data + 1 : length;
+    }
+    if (s->format.mode == RECORD_FIXED)
+        {want = s->format.width - s->carry_len;}
+    if (s->format.mode == RECORD_VARINT && read_varint(s->carry, s->carry_len, &header, &size) == 1)
+        {want = header + size - s->carry_len;}
+    return (want < length) ? want : length;
+}
+
+static int carry_append(gzsortBucket* s, char* data, int64_t length)
+{
+    while (s->carry_len + length > s->carry_size)
+    {
+        s->carry_size = s->carry_size ? s->carry_size * 2 : LINE_START;
+        s->carry = realloc(s->carry, s->carry_size);
+        if (s->carry == NULL)
+            {return 1;}
+    }
+    memcpy(s->carry + s->carry_len, data, length);
+    s->carry_len += length;
+    return 0;
+}
+
+int gzsort_push_buffer(gzsortBucket* s, char* data, int64_t length)
+{
+    int64_t frame, header, size, take;
+    // finish the record that the last buffer cut off
+    while (s->carry_len && length > 0)
+    {
+        take = carry_need(s, data, length);
+        if (carry_append(s, data, take))
+            {return 1;}
+        data += take;
+        length -= take;
+        frame = frame_size(&s->format, s->carry, s->carry_len, &header, &size);
+        if (frame < 0)
+            {return 1;}
+        if (frame == 0)
+            {continue;}
+        if (gzsort_push(s, s->carry + header, size))
+            {return 1;}
+        s->carry_len = 0;
+    }
+    // everything else straight from data
+    while (length > 0)
+    {
+        frame = frame_size(&s->format, data, length, &header, &size);
+        if (frame < 0)
+            {return 1;}
+        if (frame == 0)
+            {break;}
+        if (gzsort_push(s, data + header, size))
+            {return 1;}
+        data += frame;
+        length -= frame;
+    }
+    return carry_append(s, data, length);
+}
+
+static int stream_finish(gzsortBucket* s)
+// sorts what is in ram, or merges everything that spilled
+{
+    int r;
+    // a last line without its newline still counts
+    if (s->carry_len && s->format.mode == RECORD_TEXT)
+    {
+        if (gzsort_push(s, s->carry, s->carry_len))
+            {return 1;}
+    }
+    s->finished = 1;
+    if (s->carry_len && s->format.mode != RECORD_TEXT)
+        {fprintf(stderr, "ERROR: the input ends inside a record\n"); return 1;}
+    s->carry_len = 0;
+    if (s->misc.limit)
+        {return limit_trim(&s->limit, 0);}
+    if (!s->spilled)
+        {return presort_sort(&s->presort);}
+    if (presort_flush(&s->presort, &s->temp, &s->misc))
+        {return 1;}
+    close_gz(&s->temp);
+    s->misc.total_lines = s->pushed;
+    r = asprintf(&s->sorted_path, "%s.sorted", s->temp_path);
+    MEMCHECK;
+    r = middle_passes(s->temp_path, s->sorted_path, &s->misc);
+    // the logs went with the bottom level
+    s->misc.line_log = NULL;
+    s->misc.byte_log = NULL;
+    s->misc.first_log = NULL;
+    s->misc.last_log = NULL;
+    if (r)
+        {return 1;}
+    if (init_gz(&s->sorted, s->sorted_path, "rb", &s->format))
+        {return 1;}
+    s->spilled = 2;  // the sorted reader is open
+    return 0;
+}
+
+char* gzsort_pull(gzsortBucket* s, int* length)
+{
+    char* str;
+    if (!s->finished && stream_finish(s))
+        {s->status = 1;}
+    if (s->status)
+        {return NULL;}
+    // limit_trim() already took care of unique
+    if (s->misc.limit)
+    {
+        if (s->pull_i >= s->limit.count)
+            {return NULL;}
+        str = s->limit.strings[s->pull_i++];
+        *length = record_len(str);
+        s->pulled++;
+        return str;
+    }
+    if (s->spilled)
+    {
+        str = load_line_gz(&s->sorted);
+        if (str == NULL)
+            {return NULL;}
+        *length = s->sorted.str_len;
+        s->pulled++;
+        return str;
+    }
+    // middle_passes() took care of unique after a spill
+    do
+    {
+        if (s->pull_i >= s->presort.strings_i)
+            {return NULL;}
+        str = presort_record(&s->presort, s->pull_i++, length);
+    } while (s->misc.unique && s->pulled && compare_records(&s->format, str, *length, s->last, s->last_len) == 0);
+    s->last = str;
+    s->last_len = *length;
+    s->pulled++;
+    return str;
+}
+
+int64_t gzsort_pull_buffer(gzsortBucket* s, char* data, int64_t size)
+{
+    char* str;
+    int64_t n = 0;
+    int64_t take;
+    int length;
+    while (n < size)
+    {
+        if (s->frame_i >= s->frame_len)
+        {
+            str = gzsort_pull(s, &length);
+            if (str == NULL)
+                {break;}
+            if (s->frame_size < length + VARINT_MAX + 1)
+            {
+                s->frame_size = length + VARINT_MAX + 1;
+                s->frame = realloc(s->frame, s->frame_size);
+                if (s->frame == NULL)
+                    {return -1;}
+            }
+            s->frame_len = 0;
+            if (s->format.mode == RECORD_VARINT)
+                {s->frame_len = write_varint(s->frame, length);}
+            memcpy(s->frame + s->frame_len, str, length);
+            s->frame_len += length;
+            if (s->format.mode == RECORD_TEXT)
+                {s->frame[s->frame_len++] = '\n';}
+            s->frame_i = 0;
+        }
+        take = s->frame_len - s->frame_i;
+        if (take > size - n)
+            {take = size - n;}
+        memcpy(data + n, s->frame + s->frame_i, take);
+        s->frame_i += take;
+        n += take;
+    }
+    if (s->status)
+        {return -1;}
+    return n;
+}
+
+int gzsort_free(gzsortBucket* s)
+{
+    if (s == NULL)
+        {return 0;}
+    if (s->spilled == 1 && !s->finished)
+        {close_gz(&s->temp);}
+    if (s->spilled == 2)
+        {close_gz(&s->sorted);}
+    if (s->spilled)
+        {unlink(s->temp_path);}
+    if (s->sorted_path != NULL)
+        {unlink(s->sorted_path);}
+    // the logs are still here if middle_passes() never ran
+    free(s->misc.line_log);
+    free(s->misc.byte_log);
+    free(s->misc.first_log);
+    free(s->misc.last_log);
+    presort_free(&s->presort);
+    limit_free(&s->limit);
+    free(s->temp_path);
+    free(s->sorted_path);
+    free(s->carry);
+    free(s->frame);
+    free(s);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+
+tput bold; echo "$0"; tput sgr0
+
+true_md5="$(zcat tests/sorted_words.gz | head -n 1000 | tests/_hash.sh)"
+
+./gz-sort -L 1000 tests/random_words.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0"; tput sgr0
+    exit 1
+fi
+
+# -P 0 is unthreaded and works with -L
+./gz-sort -L 1000 -P 0 tests/random_words.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (-P 0)"; tput sgr0
+    exit 1
+fi
+
+true_md5="$(zcat tests/sorted_words.gz | uniq | head -n 1000 | tests/_hash.sh)"
+
+./gz-sort -L 1000 -u tests/random_words.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (unique)"; tput sgr0
+    exit 1
+fi
+
+# more than there is
+true_md5="$(zcat tests/small.gz | sort | tests/_hash.sh)"
+
+./gz-sort -L 1000 tests/small.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (short)"; tput sgr0
+    exit 1
+fi
+
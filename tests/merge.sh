@@ -0,0 +1,37 @@
+#!/bin/sh
+
+tput bold; echo "$0"; tput sgr0
+
+# hundreds of small sorted inputs
+zcat tests/random_words.gz | split -l 400 -a 3 - tests/part_
+for part in tests/part_???; do
+    LANG=C sort "$part" | gzip > "$part.gz"
+    rm "$part"
+done
+
+true_md5="$(zcat tests/sorted_words.gz | tests/_hash.sh)"
+
+./gz-sort -m tests/part_*.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (merge)"; tput sgr0
+    exit 1
+fi
+
+# few enough descriptors to force a cascade
+(ulimit -n 40; ./gz-sort -m tests/part_*.gz tests/result.gz)
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (cascade)"; tput sgr0
+    exit 1
+fi
+
+true_md5="$(zcat tests/sorted_words.gz | uniq | tests/_hash.sh)"
+
+(ulimit -n 40; ./gz-sort -m -u tests/part_*.gz tests/result.gz)
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (unique)"; tput sgr0
+    exit 1
+fi
+
@@ -0,0 +1,25 @@
+#!/bin/sh
+
+tput bold; echo "$0"; tput sgr0
+
+true_md5="$(zcat tests/sorted_words.gz | tests/_hash.sh)"
+
+./gz-sort -E tests/random_words.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0"; tput sgr0
+    exit 1
+fi
+
+./gz-sort -E -S 10k -D 100M tests/random_words.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (budget)"; tput sgr0
+    exit 1
+fi
+
+if ./gz-sort -E -D 1k tests/random_words.gz tests/result.gz 2> /dev/null; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (disk cap)"; tput sgr0
+    exit 1
+fi
+
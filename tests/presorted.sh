@@ -0,0 +1,31 @@
+#!/bin/sh
+
+tput bold; echo "$0"; tput sgr0
+
+# segments that do not overlap are copied without recompressing
+true_md5="$(zcat tests/sorted_words.gz | tests/_hash.sh)"
+
+./gz-sort -S 1k tests/sorted_words.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (sorted)"; tput sgr0
+    exit 1
+fi
+
+zcat tests/sorted_words.gz | sort -r | gzip > tests/reversed_words.gz
+./gz-sort -S 1k tests/reversed_words.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (reversed)"; tput sgr0
+    exit 1
+fi
+
+true_md5="$(zcat tests/sorted_words.gz | uniq | tests/_hash.sh)"
+
+./gz-sort -S 1k -u tests/sorted_words.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (unique)"; tput sgr0
+    exit 1
+fi
+
@@ -0,0 +1,68 @@
+#!/bin/sh
+
+tput bold; echo "$0"; tput sgr0
+
+export LC_ALL=C
+
+# fixed width, padded out to 16 bytes and no newlines
+fixed="{printf \"%-16.16s\", \$0}"
+zcat tests/random_words.gz | awk "$fixed" | gzip > tests/records.gz
+true_md5="$(zcat tests/sorted_words.gz | awk "$fixed" | tests/_hash.sh)"
+
+./gz-sort -R 16 -S 100k tests/records.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (fixed)"; tput sgr0
+    exit 1
+fi
+
+./gz-sort -R 16 -S 100k -P 4 tests/records.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (fixed threaded)"; tput sgr0
+    exit 1
+fi
+
+true_md5="$(zcat tests/sorted_words.gz | uniq | awk "$fixed" | tests/_hash.sh)"
+
+./gz-sort -R 16 -S 100k -u tests/records.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (fixed unique)"; tput sgr0
+    exit 1
+fi
+
+# key on the word in the back half, the line number breaks ties
+keyed="{printf \"%08d%-8.8s\", NR, \$0}"
+zcat tests/random_words.gz | awk "$keyed" | gzip > tests/records.gz
+true_md5="$(zcat tests/random_words.gz | awk "$keyed" | fold -w 16 |
+    awk '{print substr($0, 9) $0}' | sort | cut -c 9- | tr -d '\n' | tests/_hash.sh)"
+
+./gz-sort -R 16 -K 8,8 -S 100k tests/records.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (key)"; tput sgr0
+    exit 1
+fi
+
+# varint length prefixed, every word is under 128 bytes
+varint="{printf \"%c%s\", length(\$0), \$0}"
+zcat tests/random_words.gz | awk "$varint" | gzip > tests/records.gz
+true_md5="$(zcat tests/sorted_words.gz | awk "$varint" | tests/_hash.sh)"
+
+./gz-sort -V -S 100k tests/records.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (varint)"; tput sgr0
+    exit 1
+fi
+
+# a cut off record is an error, not the end of the input
+printf '\002ab\005abc' | gzip > tests/records.gz
+if ./gz-sort -V tests/records.gz tests/result.gz 2> /dev/null ||
+    ./gz-sort -V - tests/result.gz < tests/records.gz 2> /dev/null; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (cut off)"; tput sgr0
+    exit 1
+fi
+
+rm -f tests/records.gz
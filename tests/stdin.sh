@@ -0,0 +1,85 @@
+#!/bin/sh
+
+tput bold; echo "$0"; tput sgr0
+
+export LC_ALL=C
+
+true_md5="$(zcat tests/sorted_words.gz | tests/_hash.sh)"
+
+# fits in ram, no temp files
+zcat tests/random_words.gz | ./gz-sort -S 10M - tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (ram)"; tput sgr0
+    exit 1
+fi
+
+# spills to temp files
+zcat tests/random_words.gz | ./gz-sort -S 100k - tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (spill)"; tput sgr0
+    exit 1
+fi
+
+true_md5="$(zcat tests/sorted_words.gz | uniq | tests/_hash.sh)"
+
+./gz-sort -S 10M -u - tests/result.gz < tests/random_words.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (unique ram)"; tput sgr0
+    exit 1
+fi
+
+./gz-sort -S 100k -u - tests/result.gz < tests/random_words.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (unique spill)"; tput sgr0
+    exit 1
+fi
+
+true_md5="$(zcat tests/sorted_words.gz | head -n 1000 | tests/_hash.sh)"
+
+./gz-sort -L 1000 - tests/result.gz < tests/random_words.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (limit)"; tput sgr0
+    exit 1
+fi
+
+true_md5="$(zcat tests/sorted_words.gz | uniq | head -n 1000 | tests/_hash.sh)"
+
+./gz-sort -L 1000 -u - tests/result.gz < tests/random_words.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (unique limit)"; tput sgr0
+    exit 1
+fi
+
+# a last line without a newline is kept, same as from a file
+printf 'b\na\nc' | ./gz-sort - tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+printf 'b\na\nc' | gzip > tests/partial.gz
+./gz-sort tests/partial.gz tests/result.gz
+true_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ] || [ "$test_md5" != "$(printf 'a\nb\nc\n' | tests/_hash.sh)" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (last line)"; tput sgr0
+    exit 1
+fi
+rm -f tests/partial.gz
+
+# options the stream can not honour
+if ./gz-sort -P 2 - tests/result.gz < tests/random_words.gz > /dev/null; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (threads)"; tput sgr0
+    exit 1
+fi
+
+varint="{printf \"%c%s\", length(\$0), \$0}"
+true_md5="$(zcat tests/sorted_words.gz | awk "$varint" | tests/_hash.sh)"
+
+zcat tests/random_words.gz | awk "$varint" | ./gz-sort -V -S 100k - tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (varint)"; tput sgr0
+    exit 1
+fi
@@ -18,6 +18,13 @@ if [ "$true_md5" != "$test_md5" ]; then
     exit 1
 fi
 
+./gz-sort -P 4 -A tests/random_words.gz tests/result.gz
+test_md5="$(zcat tests/result.gz | tests/_hash.sh)"
+if [ "$true_md5" != "$test_md5" ]; then
+    tput setaf 1; tput rev; echo "ERROR - $0 (pinned)"; tput sgr0
+    exit 1
+fi
+
 
 true_md5="$(zcat tests/sorted_words.gz | uniq | tests/_hash.sh)"
 